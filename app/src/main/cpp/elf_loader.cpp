@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cerrno>
+#include <cstring>
 #include <string>
 #include <android/asset_manager.h>
 #include <android/asset_manager_jni.h>
@@ -20,11 +21,25 @@
 #define OFFSET_P_OFFSET 0x8
 #define OFFSET_P_FILE_SIZE 0x20
 
+// Constant for the symbol table section
+#define SHT_SYMTAB 0x2
+
+// Absolut offsets of the section header fields in an ELF file
+#define SH_OFF 0x28
+#define SH_ENT_SIZE 0x3A
+#define SH_NUM 0x3C
+
+// Relative offsets to section header entries and symbol table entries in an ELF file
+#define OFFSET_SH_TYPE 0x4
+#define OFFSET_SH_OFFSET 0x18
+#define OFFSET_SH_SIZE 0x20
+#define OFFSET_SH_LINK 0x28
+#define OFFSET_SH_ENT_SIZE 0x38
+#define OFFSET_ST_VALUE 0x8
+
 #define TAG "HELLO_KVM"
 
 #define PATH "bin"
-#define FILENAME "hello_world.elf"
-#define URI "bin/hello_world.elf"
 
 // AAssetManager variables
 AAssetManager *mgr;
@@ -121,29 +136,31 @@ void parse_program_header(uint64_t phoff, uint16_t phentsize) {
         }
     }
 
-    code_blocks = (uint32_t **) malloc(p_hdr_n * sizeof(uint32_t *));
-    for (int i = 0; i < p_hdr_n; i++) {
-        code_blocks[i] = (uint32_t *) malloc(memsz[i]);
-    }
+    // The code blocks are only allocated when their section is loaded.
+    code_blocks = (uint32_t **) calloc(p_hdr_n, sizeof(uint32_t *));
 }
 
-bool elf_file_exists() {
+bool elf_file_exists(const char *elf_filename) {
     const char *filename;
-    bool found;
-    do {
-        filename = AAssetDir_getNextFileName(assetDir);
-        found = strcmp(filename, FILENAME) == 0;
-    } while (filename != NULL && !found);
+    bool found = false;
+    while (!found && (filename = AAssetDir_getNextFileName(assetDir)) != NULL) {
+        found = strcmp(filename, elf_filename) == 0;
+    }
     return found;
 }
 
-int open_elf(AAssetManager *pmgr) {
+int open_elf(AAssetManager *pmgr, const char *filename) {
     if (pmgr == nullptr) {
         __android_log_print(ANDROID_LOG_INFO, TAG, "AAssetManager is null");
         return -1;
     }
     mgr = pmgr;
-    __android_log_print(ANDROID_LOG_INFO, TAG, "Opening ELF file");
+    __android_log_print(ANDROID_LOG_INFO, TAG, "Opening ELF file %s", filename);
+
+    // Reset the state of a previously loaded ELF file
+    byte_index = 0;
+    section = -1;
+    has_next = 0;
 
     assetDir = AAssetManager_openDir(mgr, PATH);
     if (assetDir == nullptr) {
@@ -151,12 +168,13 @@ int open_elf(AAssetManager *pmgr) {
         return -1;
     }
 
-    if (!elf_file_exists()) {
+    if (!elf_file_exists(filename)) {
         __android_log_print(ANDROID_LOG_INFO, TAG, "ELF file not found");
         return -1;
     }
 
-    asset = AAssetManager_open(mgr, URI, AASSET_MODE_STREAMING);
+    std::string uri = std::string(PATH) + "/" + filename;
+    asset = AAssetManager_open(mgr, uri.c_str(), AASSET_MODE_STREAMING);
     if (asset == nullptr) {
         __android_log_print(ANDROID_LOG_INFO, TAG, "AAsset is null");
         return -1;
@@ -218,6 +236,7 @@ int get_next_section_to_load(uint32_t **code, size_t *memory_size, uint64_t *vad
     }
 
     to(offset[section]);
+    code_blocks[section] = (uint32_t *) malloc(memsz[section]);
     read(code_blocks[section], filesz[section]);
 
     *code = code_blocks[section];
@@ -227,6 +246,39 @@ int get_next_section_to_load(uint32_t **code, size_t *memory_size, uint64_t *vad
     return 0;
 }
 
+int get_next_section_location(uint64_t *file_offset, size_t *file_size, size_t *memory_size,
+                              uint64_t *vaddress) {
+    if (!has_next) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "No more section available. "
+                                                   "Check availability with has_next_section_to_load() prior to calling this method.");
+        return -1;
+    }
+
+    *file_offset = offset[section];
+    *file_size = filesz[section];
+    *memory_size = memsz[section];
+    *vaddress = vaddr[section];
+
+    return 0;
+}
+
+int get_elf_file_descriptor(AAssetManager *pmgr, const char *filename, off64_t *start) {
+    std::string uri = std::string(PATH) + "/" + filename;
+    AAsset *elf_asset = AAssetManager_open(pmgr, uri.c_str(), AASSET_MODE_UNKNOWN);
+    if (elf_asset == nullptr) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "AAsset is null");
+        return -1;
+    }
+
+    off64_t length;
+    int fd = AAsset_openFileDescriptor64(elf_asset, start, &length);
+    if (fd < 0)
+        __android_log_print(ANDROID_LOG_INFO, TAG, "ELF file %s is compressed in the APK", filename);
+
+    AAsset_close(elf_asset);
+    return fd;
+}
+
 uint64_t get_entry_address() {
     return entry_address;
 }
@@ -248,3 +300,76 @@ void close_elf() {
     AAssetDir_close(assetDir);
 }
 
+
+/**
+ * Reads a value at an absolut offset of an ELF file that is completely in memory.
+ *
+ * @return true on success, false if the value is outside of the file.
+ */
+template<typename T>
+bool read_at(const uint8_t *elf, size_t elf_len, uint64_t off, T *value) {
+    if (off > elf_len || sizeof(T) > elf_len - off)
+        return false;
+    memcpy(value, elf + off, sizeof(T));
+    return true;
+}
+
+/**
+ * Searches the symbol table of an ELF file that is completely in memory.
+ *
+ * @return 0 on success, -1 if the symbol was not found.
+ */
+int find_symbol(const uint8_t *elf, size_t elf_len, const char *name, uint64_t *address) {
+    uint64_t shoff;
+    uint16_t shentsize, shnum;
+    if (!read_at(elf, elf_len, SH_OFF, &shoff) || !read_at(elf, elf_len, SH_ENT_SIZE, &shentsize) ||
+        !read_at(elf, elf_len, SH_NUM, &shnum))
+        return -1;
+
+    for (int i = 0; i < shnum; i++) {
+        uint64_t sh = shoff + i * shentsize;
+        uint32_t sh_type, sh_link;
+        uint64_t sym_off, sym_size, sym_ent_size, str_sh, str_off;
+        if (!read_at(elf, elf_len, sh + OFFSET_SH_TYPE, &sh_type) || sh_type != SHT_SYMTAB)
+            continue;
+        if (!read_at(elf, elf_len, sh + OFFSET_SH_OFFSET, &sym_off) ||
+            !read_at(elf, elf_len, sh + OFFSET_SH_SIZE, &sym_size) ||
+            !read_at(elf, elf_len, sh + OFFSET_SH_ENT_SIZE, &sym_ent_size) ||
+            !read_at(elf, elf_len, sh + OFFSET_SH_LINK, &sh_link) || sym_ent_size == 0)
+            return -1;
+        // The linked section is the string table of the symbol names.
+        str_sh = shoff + sh_link * shentsize;
+        if (!read_at(elf, elf_len, str_sh + OFFSET_SH_OFFSET, &str_off) || str_off >= elf_len)
+            return -1;
+
+        for (uint64_t sym = sym_off; sym + sym_ent_size <= sym_off + sym_size; sym += sym_ent_size) {
+            uint32_t st_name;
+            if (!read_at(elf, elf_len, sym, &st_name) || str_off + st_name >= elf_len)
+                return -1;
+            const char *sym_name = reinterpret_cast<const char *>(elf + str_off + st_name);
+            if (strncmp(sym_name, name, elf_len - str_off - st_name) == 0)
+                return read_at(elf, elf_len, sym + OFFSET_ST_VALUE, address) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+int get_symbol_address(AAssetManager *pmgr, const char *filename, const char *name,
+                       uint64_t *address) {
+    std::string uri = std::string(PATH) + "/" + filename;
+    AAsset *elf_asset = AAssetManager_open(pmgr, uri.c_str(), AASSET_MODE_BUFFER);
+    if (elf_asset == nullptr) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "AAsset is null");
+        return -1;
+    }
+
+    const uint8_t *elf = static_cast<const uint8_t *>(AAsset_getBuffer(elf_asset));
+    int ret = -1;
+    if (elf != nullptr)
+        ret = find_symbol(elf, AAsset_getLength(elf_asset), name, address);
+    if (ret < 0)
+        __android_log_print(ANDROID_LOG_INFO, TAG, "Symbol %s not found", name);
+
+    AAsset_close(elf_asset);
+    return ret;
+}
@@ -2,13 +2,15 @@
 #define OPTEE_CLIENT_KVM_ELF_LOADER_H
 
 #include <cstdint>
+#include <android/asset_manager.h>
 
 /**
  * Opens an ELF file for loading. This must be called before any other function.
- * @param path The absolut path and name of the ELF file to open.
+ * @param mgr The asset manager of the app.
+ * @param filename The name of the ELF file to open in the 'bin' asset directory.
  * @return 0 on success, -1 if an error occurred.
  */
-int open_elf(AAssetManager *mgr);
+int open_elf(AAssetManager *mgr, const char *filename);
 
 /**
  * Checks whether there is another section to load or not.
@@ -28,12 +30,48 @@ int has_next_section_to_load();
  */
 int get_next_section_to_load(uint32_t **code, size_t *memory_size, uint64_t *vaddress);
 
+/**
+ * Returns where the next section to load is stored in the ELF file, without reading it.
+ * Prior to calling this function, has_next_section_to_load() has to be called.
+ *
+ * @param file_offset The offset of the section in the ELF file.
+ * @param file_size The size of the section in the ELF file in bytes.
+ * @param memory_size The size of the section in memory in bytes, the rest is zero.
+ * @param vaddress The virtual address where the section should be loaded to.
+ * @return 0 on success, -1 if an error occurred.
+ */
+int get_next_section_location(uint64_t *file_offset, size_t *file_size, size_t *memory_size,
+                              uint64_t *vaddress);
+
 /**
  * Returns the entry address of the program, when it is loaded into memory.
  * @return The entry address.
  */
 uint64_t get_entry_address();
 
+/**
+ * Returns the address of a symbol in an ELF file. This is independent of open_elf().
+ *
+ * @param mgr The asset manager of the app.
+ * @param filename The name of the ELF file in the 'bin' asset directory.
+ * @param name The name of the symbol.
+ * @param address The address of the symbol.
+ * @return 0 on success, -1 if the symbol was not found.
+ */
+int get_symbol_address(AAssetManager *mgr, const char *filename, const char *name,
+                       uint64_t *address);
+
+/**
+ * Opens a file descriptor of an ELF file in the APK, so that its content can be read on demand.
+ * This only works for ELF files that are stored uncompressed. This is independent of open_elf().
+ *
+ * @param mgr The asset manager of the app.
+ * @param filename The name of the ELF file in the 'bin' asset directory.
+ * @param start The offset of the ELF file in the file descriptor.
+ * @return The file descriptor, which has to be closed by the caller, or -1 if an error occurred.
+ */
+int get_elf_file_descriptor(AAssetManager *mgr, const char *filename, off64_t *start);
+
 /**
  * Closes an ELF file after loading and frees allocated resources.
  */
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "elf_loader.h"
+#include "image_store.h"
+
+#define MAX_STRING_LENGTH 100
+
+// Available since Linux 5.1, but missing in the headers of older NDKs
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// The images that have been loaded so far, by ELF filename
+std::map<std::string, guest_image> images;
+
+image_log_callback image_log;
+char image_log_buffer[MAX_STRING_LENGTH];
+
+/**
+ * Formats a log line and passes it to the log callback.
+ */
+void log_image(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(image_log_buffer, MAX_STRING_LENGTH, format, ap);
+    va_end(ap);
+    image_log(image_log_buffer);
+}
+
+int find_mapping_for_section(const memory_mapping *mappings, int n_mappings, uint64_t target_addr) {
+    // Iterate over the memory mappings from high addresses to lower addresses.
+    for (int i = n_mappings - 1; i >= 0; i--) {
+        // As soon as one mapping has a lower guest address as the target address, the right mapping is found.
+        if (mappings[i].guest_phys_addr <= target_addr) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Creates a memfd that allows sealing and maps it writable, so the image can be copied into it.
+ *
+ * @param name The name of the memfd for debugging.
+ * @param size The size of the memfd.
+ * @param mem The host address of the writable mapping.
+ * @return The file descriptor or -1 if an error occurred.
+ */
+int create_image_memfd(const char *name, size_t size, uint8_t **mem) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        log_image("memfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        log_image("ftruncate failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void *void_mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (void_mem == MAP_FAILED) {
+        log_image("mmap of memfd failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *mem = static_cast<uint8_t *>(void_mem);
+    return fd;
+}
+
+/**
+ * Copies the required sections of the ELF file into the memfds of the image.
+ *
+ * @return 0 on success, -1 if an error occurred.
+ */
+int copy_elf_into_image(AAssetManager *mgr, const char *filename, const memory_mapping *mappings,
+                        int n_mappings, uint8_t **mems, guest_image *image) {
+    // Open the ELF file that will be loaded into memory
+    if (open_elf(mgr, filename) != 0)
+        return -1;
+
+    uint32_t *code;
+    size_t memsz;
+    uint64_t target_addr;
+    int ret = 0;
+    // Iterate over the segments in the ELF file and load them into the memfds
+    while (ret == 0 && has_next_section_to_load()) {
+        if (get_next_section_to_load(&code, &memsz, &target_addr) < 0) {
+            ret = -1;
+            break;
+        }
+        int mmi = find_mapping_for_section(mappings, n_mappings, target_addr);
+        if (mmi < 0) {
+            ret = -1;
+            break;
+        }
+
+        // There can be an offset between memory mapping and the target address.
+        uint64_t offset = target_addr - mappings[mmi].guest_phys_addr;
+        if (offset + memsz > mappings[mmi].memory_size) {
+            log_image("Memory mapping too small. Mapping offset: 0x%08lX - Mapping size: 0x%08lX",
+                      offset, mappings[mmi].memory_size);
+            ret = -1;
+            break;
+        }
+        memcpy(mems[mmi] + offset, code, memsz);
+        log_image("Section loaded into image. Guest address: 0x%08lX", target_addr);
+    }
+
+    image->entry_address = get_entry_address();
+    close_elf();
+    return ret;
+}
+
+/**
+ * Loads an ELF file into one sealed memfd per memory mapping.
+ *
+ * @return 0 on success, -1 if an error occurred.
+ */
+int load_guest_image(AAssetManager *mgr, const char *filename, const memory_mapping *mappings,
+                     int n_mappings, guest_image *image) {
+    uint8_t *mems[MAX_IMAGE_MAPPINGS];
+    int ret = 0;
+
+    image->n_mappings = 0;
+    for (int i = 0; i < n_mappings && ret == 0; i++) {
+        image->memfds[i] = create_image_memfd(filename, mappings[i].memory_size, &mems[i]);
+        if (image->memfds[i] < 0)
+            ret = -1;
+        else
+            image->n_mappings++;
+    }
+
+    if (ret == 0)
+        ret = copy_elf_into_image(mgr, filename, mappings, n_mappings, mems, image);
+
+    /*
+     * F_SEAL_FUTURE_WRITE only forbids new writes, F_SEAL_WRITE would also forbid the read-only
+     * MAP_SHARED mappings of the VMs on kernels before 6.7, which count every shared mapping as
+     * writable. The writable mappings are not needed anymore, so nothing can change the image.
+     */
+    for (int i = 0; i < image->n_mappings; i++) {
+        munmap(mems[i], mappings[i].memory_size);
+        if (ret == 0 && fcntl(image->memfds[i], F_ADD_SEALS,
+                              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+            log_image("Sealing memfd failed: %s", strerror(errno));
+            ret = -1;
+        }
+    }
+
+    if (ret < 0) {
+        for (int i = 0; i < image->n_mappings; i++) {
+            close(image->memfds[i]);
+        }
+    }
+    return ret;
+}
+
+const guest_image *get_guest_image(AAssetManager *mgr, const char *filename,
+                                   const memory_mapping *mappings, int n_mappings,
+                                   image_log_callback log) {
+    image_log = log;
+    if (n_mappings > MAX_IMAGE_MAPPINGS) {
+        log_image("Too many memory mappings for an image: %d", n_mappings);
+        return nullptr;
+    }
+
+    auto it = images.find(filename);
+    if (it != images.end()) {
+        log_image("Image %s already loaded", filename);
+        return &it->second;
+    }
+
+    guest_image image{};
+    if (load_guest_image(mgr, filename, mappings, n_mappings, &image) < 0)
+        return nullptr;
+    return &images.emplace(filename, image).first->second;
+}
@@ -0,0 +1,58 @@
+#ifndef ANDROID_KVM_HELLO_WORLD_IMAGE_STORE_H
+#define ANDROID_KVM_HELLO_WORLD_IMAGE_STORE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <android/asset_manager.h>
+
+#define MAX_IMAGE_MAPPINGS 4
+
+// Memory mappings between host and guest
+struct memory_mapping {
+    uint64_t guest_phys_addr;
+    size_t memory_size;
+    uint64_t *userspace_addr;
+};
+
+// Receives the log lines of the image store
+typedef void (*image_log_callback)(const char *line);
+
+/**
+ * A guest image that is loaded into one sealed memfd per memory mapping.
+ * The memfds stay open until the process exits and are a per-process cache: every VM of this
+ * process that runs the image maps them instead of loading the ELF file again. They are not
+ * shared with other processes.
+ */
+struct guest_image {
+    uint64_t entry_address;
+    int n_mappings;
+    int memfds[MAX_IMAGE_MAPPINGS];
+};
+
+/**
+ * Finds the memory mapping for the specified target_addr.
+ *
+ * @param mappings The memory mappings, sorted by guest address.
+ * @param n_mappings The number of memory mappings.
+ * @param target_addr The guest address that will be searched for in the memory mappings.
+ * @return Returns the index of the memory mapping or -1 if no mapping was found.
+ */
+int find_mapping_for_section(const memory_mapping *mappings, int n_mappings, uint64_t target_addr);
+
+/**
+ * Returns the image of an ELF file. The ELF file is only loaded on the first call for a filename,
+ * later calls return the same image. Every image is expected to use the same memory mappings.
+ * This is not thread-safe, just like the rest of the VM setup.
+ *
+ * @param mgr The asset manager of the app.
+ * @param filename The name of the ELF file in the 'bin' asset directory.
+ * @param mappings The memory mappings the sections of the ELF file are loaded into.
+ * @param n_mappings The number of memory mappings, at most MAX_IMAGE_MAPPINGS.
+ * @param log Receives the log lines of loading the image.
+ * @return The image or nullptr if an error occurred.
+ */
+const guest_image *get_guest_image(AAssetManager *mgr, const char *filename,
+                                   const memory_mapping *mappings, int n_mappings,
+                                   image_log_callback log);
+
+#endif //ANDROID_KVM_HELLO_WORLD_IMAGE_STORE_H
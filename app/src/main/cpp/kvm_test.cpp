@@ -12,26 +12,67 @@
 #include <android/asset_manager_jni.h>
 
 #include "elf_loader.h"
+#include "image_store.h"
+#include "lazy_memory.h"
 
 #define MAX_VM_RUNS 20
 #define MAX_STRING_LENGTH 100
 #define KVM_ARM_VCPU_PSCI_0_2 2
 #define N_MEMORY_MAPPINGS 2
 #define MEMORY_BLOCK_SIZE 0x1000
+#define RAM_SIZE 0x10000
+#define IMAGE_FILENAME "hello_world.elf"
+#define LAZY_PREFETCH_PAGES 1
+#define MAX_LAZY_EXTENTS 4
+#define STACK_TOP 0x04020000
+#define MMIO_ADDRESS 0x10000000
+
+// Register identifiers for KVM_SET_ONE_REG and KVM_GET_ONE_REG
+#define REG_X(n) (0x6030000000100000 + 2 * (n))
+#define REG_PC 0x6030000000100040
+#define REG_SP_EL1 0x6030000000100044
+
+// VM session
+#define SESSION_MAX_ARGS 8
+#define SESSION_MAX_EXITS 4096
+#define SESSION_MAX_OUTPUT 1024
+#define SESSION_EAGER_MEMORY 1 // vm_session_open() result if lazy memory was requested but is not available
+#define SESSION_TRAMPOLINE_ADDRESS 0x0FFFF000
+#define SESSION_FREE_PAGE_REPORTER_ADDRESS (SESSION_TRAMPOLINE_ADDRESS + 0x40)
+#define SESSION_RETURN_ADDRESS (MMIO_ADDRESS + 0x8)
+#define SESSION_RETURN_FUNCTION_ID 0xC3000000 // SMC64 fast call in the OEM service range
+
+// Free page reporting. The guest writes the start of a free range, then its length to release it.
+#define MAX_MEMORY_SLOTS 8
+#define PAGEMAP_CHUNK_ENTRIES 512
+#define FREE_PAGE_ADDRESS (MMIO_ADDRESS + 0x10)
+#define FREE_PAGE_LENGTH (MMIO_ADDRESS + 0x18)
 
 using namespace std;
 
-int kvm, vmfd, vcpufd;
-struct kvm_run *run;
+int kvm = -1, vmfd = -1, vcpufd = -1;
+struct kvm_run *run = nullptr;
+size_t run_mmap_size;
 u_int32_t memory_slot_count = 0;
 
-// Memory mappings between host and guest
-struct memory_mapping {
+// The host memory of all memory slots of the VM
+struct memory_slot {
+    uint64_t *userspace_addr;
     uint64_t guest_phys_addr;
     size_t memory_size;
-    uint64_t *userspace_addr;
+    bool shared;
+    bool read_only;
+    bool image_backed;
 };
+memory_slot memory_slots[MAX_MEMORY_SLOTS];
+size_t host_page_size;
+uint64_t free_page_address;
+
 memory_mapping memory_mappings[N_MEMORY_MAPPINGS];
+const guest_image *image;
+uint64_t guest_entry_address;
+bool lazy_memory = false;
+int lazy_image_fd = -1;
 
 int mmio_buffer_index = 0;
 char mmio_buffer[MAX_VM_RUNS];
@@ -39,6 +80,9 @@ char mmio_buffer[MAX_VM_RUNS];
 string output_text;
 char buffer[MAX_STRING_LENGTH];
 
+// The MMIO output of the last session call
+string session_output;
+
 /**
  * Execute an ioctl with the given arguments. Exit the program if there is an error.
  *
@@ -64,6 +108,14 @@ int ioctl_exit_on_error(int file_descriptor, unsigned long request, string name,
     return ret;
 }
 
+/**
+ * Appends a log line of another module to the output text.
+ */
+void append_output_line(const char *line) {
+    output_text += line;
+    output_text += '\n';
+}
+
 /**
  * Checks the availability of a KVM extension. Exits on errors and if the extension is not available.
  *
@@ -88,22 +140,30 @@ int check_vm_extension(int extension, string name) {
 }
 
 /**
- * Allocates memory and assigns it to the VM as guest memory.
+ * Assigns host memory to the VM as guest memory.
  *
- * @param memory_len The length of the memory that shall be allocated.
+ * @param mem The host memory that shall be assigned.
+ * @param memory_len The length of the memory.
  * @param guest_addr The address of the memory in the guest.
- * @return A pointer to the allocated memory.
+ * @param flags The flags of the memory region, e.g. KVM_MEM_READONLY.
+ * @param shared Whether the host memory is a shared mapping.
+ * @param image_backed Whether the host memory is a mapping of a guest image memfd.
  */
-uint64_t *allocate_memory_to_vm(size_t memory_len, uint64_t guest_addr, uint32_t flags = 0) {
-    void *void_mem = mmap(NULL, memory_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
-                          0);
-    uint64_t *mem = static_cast<uint64_t *>(void_mem);
-    if (!mem) {
-        snprintf(buffer, MAX_STRING_LENGTH, "Error while allocating guest memory: %s\n",
-                 strerror(errno));
+void assign_memory_to_vm(uint64_t *mem, size_t memory_len, uint64_t guest_addr, uint32_t flags,
+                         bool shared, bool image_backed) {
+    if (memory_slot_count >= MAX_MEMORY_SLOTS) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Too many memory slots\n");
         output_text += buffer;
         exit(-1);
     }
+    memory_slots[memory_slot_count] = {
+            .userspace_addr = mem,
+            .guest_phys_addr = guest_addr,
+            .memory_size = memory_len,
+            .shared = shared,
+            .read_only = (flags & KVM_MEM_READONLY) != 0,
+            .image_backed = image_backed,
+    };
 
     struct kvm_userspace_memory_region region = {
             .slot = memory_slot_count,
@@ -114,98 +174,314 @@ uint64_t *allocate_memory_to_vm(size_t memory_len, uint64_t guest_addr, uint32_t
     };
     memory_slot_count++;
     ioctl_exit_on_error(vmfd, KVM_SET_USER_MEMORY_REGION, "KVM_SET_USER_MEMORY_REGION", &region);
+}
+
+/**
+ * Allocates memory and assigns it to the VM as guest memory.
+ *
+ * @param memory_len The length of the memory that shall be allocated.
+ * @param guest_addr The address of the memory in the guest.
+ * @return A pointer to the allocated memory.
+ */
+uint64_t *allocate_memory_to_vm(size_t memory_len, uint64_t guest_addr, uint32_t flags = 0) {
+    void *void_mem = mmap(NULL, memory_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                          0);
+    if (void_mem == MAP_FAILED) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Error while allocating guest memory: %s\n",
+                 strerror(errno));
+        output_text += buffer;
+        exit(-1);
+    }
+    uint64_t *mem = static_cast<uint64_t *>(void_mem);
+
+    assign_memory_to_vm(mem, memory_len, guest_addr, flags, true, false);
     return mem;
 }
 
 /**
- * Finds the memory mapping for the specified target_addr.
+ * Maps a memfd of a guest image and assigns it to the VM as guest memory.
+ * Read-only mappings use the pages of the memfd directly. Writable mappings are private, so the
+ * pages are only copied when the guest writes to them.
  *
- * @param target_addr The guest address that will be searched for in the memory mappings.
- * @return Returns the index of the memory mapping or -1 if no mapping was found.
- */
-int find_mapping_for_section(uint64_t target_addr) {
-    // Iterate over the memory mappings from high addresses to lower addresses.
-    for (int i = N_MEMORY_MAPPINGS-1; i >= 0; i--) {
-        // As soon as one mapping has a lower guest address as the target address, the right mapping is found.
-        if (memory_mappings[i].guest_phys_addr <= target_addr) {
-            return i;
-        }
+ * @param memfd The memfd of the guest image.
+ * @param mapping The memory mapping that the memfd belongs to.
+ * @param read_only Whether the guest memory is read-only.
+ * @return A pointer to the mapped memory.
+ */
+uint64_t *map_image_to_vm(int memfd, const memory_mapping &mapping, bool read_only) {
+    int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = read_only ? MAP_SHARED : MAP_PRIVATE;
+    void *void_mem = mmap(NULL, mapping.memory_size, prot, flags, memfd, 0);
+    if (void_mem == MAP_FAILED) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Error while mapping guest image: %s\n",
+                 strerror(errno));
+        output_text += buffer;
+        exit(-1);
     }
+    uint64_t *mem = static_cast<uint64_t *>(void_mem);
 
-    return -1;
+    assign_memory_to_vm(mem, mapping.memory_size, mapping.guest_phys_addr,
+                        read_only ? KVM_MEM_READONLY : 0, read_only, true);
+    return mem;
 }
 
 /**
- * Copies the code into the memory of the specified memory mapping.
+ * Allocates memory that is only populated when the guest touches it and assigns it to the VM.
+ * Falls back to zeroed memory from allocate_memory_to_vm() if the lazy population mode is not active.
  *
- * @param code The code blok that will be copied into the VM memory.
- * @param memsz The size of the code block.
- * @param target_addr The VM memory address that the code will be copied to.
- * @param mmi The index of the memory mapping that will be used for copying.
- * @return Returns the index of the memory mapping or -1 if no mapping was found.
- */
-int copy_section_into_memory(uint32_t *code, size_t memsz, uint64_t target_addr, int mmi) {
-    // There can be an offset between memory mapping and the target address.
-    uint64_t offset = target_addr - memory_mappings[mmi].guest_phys_addr;
-
-    // If the offset plus the code size is bigger than the memory mapping size, do nothing.
-    if (offset + memsz > memory_mappings[mmi].memory_size) {
-        snprintf(buffer, MAX_STRING_LENGTH, "Memory mapping too small. Mapping offset: 0x%08lX - Mapping size: 0x%08lX\n", offset, memory_mappings[mmi].memory_size);
+ * @param memory_len The length of the memory that shall be allocated.
+ * @param guest_addr The address of the memory in the guest.
+ * @param flags The flags of the memory region, e.g. KVM_MEM_READONLY.
+ * @param source_fd The file the extents are read from or LAZY_ZERO_SOURCE.
+ * @param extents The parts of the memory that are read from the source file.
+ * @param n_extents The number of extents.
+ * @return A pointer to the allocated memory.
+ */
+uint64_t *allocate_lazy_memory_to_vm(size_t memory_len, uint64_t guest_addr, uint32_t flags = 0,
+                                     int source_fd = LAZY_ZERO_SOURCE,
+                                     const lazy_extent *extents = nullptr, int n_extents = 0) {
+    if (!lazy_memory)
+        return allocate_memory_to_vm(memory_len, guest_addr, flags);
+
+    // userfaultfd only handles missing pages of private anonymous memory in all supported kernels.
+    void *void_mem = mmap(NULL, memory_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+    if (void_mem == MAP_FAILED) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Error while allocating guest memory: %s\n",
+                 strerror(errno));
         output_text += buffer;
-        return -1;
+        exit(-1);
     }
+    uint64_t *mem = static_cast<uint64_t *>(void_mem);
 
-    // Copy the code into the VM memory
-    memcpy(memory_mappings[mmi].userspace_addr + offset, code, memsz);
-    snprintf(buffer, MAX_STRING_LENGTH, "Section loaded. Host address: %p - Guest address: 0x%08lX\n", memory_mappings[mmi].userspace_addr + offset, target_addr);
-    output_text += buffer;
-    return 0;
+    if (register_lazy_region(mem, memory_len, source_fd, extents, n_extents) < 0) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Error while registering lazy guest memory\n");
+        output_text += buffer;
+        exit(-1);
+    }
+    assign_memory_to_vm(mem, memory_len, guest_addr, flags, false, false);
+    return mem;
 }
 
 /**
- * Copies the required sections of the ELF file into the memory of the VM.
+ * Assigns ROM and RAM to the VM, so that they are populated from the ELF file on the first guest
+ * access. Only the headers of the ELF file are read here, neither the image store nor the ELF
+ * loader copies the sections. The ELF file has to be stored uncompressed in the APK.
  *
  * @return 0 on success, -1 if an error occurred.
  */
-int copy_elf_into_memory(AAssetManager *mgr) {
-    // Open the ELF file that will be loaded into memory
-    if (open_elf(mgr) != 0)
+int map_lazy_image(AAssetManager *mgr) {
+    off64_t elf_start;
+    lazy_image_fd = get_elf_file_descriptor(mgr, IMAGE_FILENAME, &elf_start);
+    if (lazy_image_fd < 0) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Cannot open '%s' for lazy loading\n", IMAGE_FILENAME);
+        output_text += buffer;
         return -1;
-
-    uint32_t *code;
-    size_t memsz;
-    uint64_t target_addr;
-    // Iterate over the segments in the ELF file and load them into the memory of the VM
-    while (has_next_section_to_load()) {
-        if (get_next_section_to_load(&code, &memsz, &target_addr) < 0)
-            return -1;
-        int mmi = find_mapping_for_section(target_addr);
-        if (mmi < 0)
-            return -1;
-        if (copy_section_into_memory(code, memsz, target_addr, mmi) < 0)
-            return -1;
     }
+    if (open_elf(mgr, IMAGE_FILENAME) != 0)
+        return -1;
+
+    // The extents of the sections in each memory mapping
+    lazy_extent extents[N_MEMORY_MAPPINGS][MAX_LAZY_EXTENTS];
+    int n_extents[N_MEMORY_MAPPINGS] = {};
+    uint64_t file_offset, target_addr;
+    size_t file_size, memsz;
+    int ret = 0;
+    while (ret == 0 && has_next_section_to_load()) {
+        if (get_next_section_location(&file_offset, &file_size, &memsz, &target_addr) < 0) {
+            ret = -1;
+            break;
+        }
+        int mmi = find_mapping_for_section(memory_mappings, N_MEMORY_MAPPINGS, target_addr);
+        if (mmi < 0 || n_extents[mmi] >= MAX_LAZY_EXTENTS) {
+            ret = -1;
+            break;
+        }
 
+        uint64_t offset = target_addr - memory_mappings[mmi].guest_phys_addr;
+        if (offset + memsz > memory_mappings[mmi].memory_size) {
+            snprintf(buffer, MAX_STRING_LENGTH, "Memory mapping too small for section at 0x%08lX\n",
+                     target_addr);
+            output_text += buffer;
+            ret = -1;
+            break;
+        }
+        // The part of the section that is not in the file stays zero.
+        extents[mmi][n_extents[mmi]++] = {
+                .offset = offset,
+                .source_offset = (off_t) (elf_start + file_offset),
+                .len = file_size,
+        };
+        snprintf(buffer, MAX_STRING_LENGTH, "Section mapped lazily. Guest address: 0x%08lX\n",
+                 target_addr);
+        output_text += buffer;
+    }
+    guest_entry_address = get_entry_address();
     close_elf();
+    if (ret < 0)
+        return ret;
+
+    /* ROM Memory, read-only */
+    memory_mappings[0].userspace_addr = allocate_lazy_memory_to_vm(
+            memory_mappings[0].memory_size, memory_mappings[0].guest_phys_addr, KVM_MEM_READONLY,
+            lazy_image_fd, extents[0], n_extents[0]);
+    /* RAM Memory */
+    memory_mappings[1].userspace_addr = allocate_lazy_memory_to_vm(
+            memory_mappings[1].memory_size, memory_mappings[1].guest_phys_addr, 0,
+            lazy_image_fd, extents[1], n_extents[1]);
     return 0;
 }
 
+/**
+ * Releases the host memory of guest pages that the guest has reported as free.
+ * Only whole pages inside writable memory slots are released. Shared memory is removed from the
+ * shared memory object, private memory is dropped and reads back as zeros or as the image content.
+ *
+ * @param guest_addr The guest address of the free range.
+ * @param len The length of the free range.
+ * @return The number of bytes released.
+ */
+size_t release_guest_pages(uint64_t guest_addr, uint64_t len) {
+    uint64_t start = (guest_addr + host_page_size - 1) & ~(uint64_t) (host_page_size - 1);
+    uint64_t end = (guest_addr + len) & ~(uint64_t) (host_page_size - 1);
+    size_t released = 0;
+
+    for (uint32_t i = 0; i < memory_slot_count && start < end; i++) {
+        memory_slot &slot = memory_slots[i];
+        if (slot.read_only)
+            continue;
+        uint64_t slot_start = max(start, slot.guest_phys_addr);
+        uint64_t slot_end = min(end, slot.guest_phys_addr + slot.memory_size);
+        if (slot_start >= slot_end)
+            continue;
+
+        uint8_t *host_addr = reinterpret_cast<uint8_t *>(slot.userspace_addr) +
+                             (slot_start - slot.guest_phys_addr);
+        if (madvise(host_addr, slot_end - slot_start, slot.shared ? MADV_REMOVE : MADV_DONTNEED) < 0) {
+            snprintf(buffer, MAX_STRING_LENGTH, "Error while releasing guest memory: %s\n",
+                     strerror(errno));
+            output_text += buffer;
+            continue;
+        }
+        released += slot_end - slot_start;
+    }
+    return released;
+}
+
+/**
+ * Counts the resident host memory of all memory slots of the VM with /proc/self/pagemap.
+ * Pages of image-backed slots that still belong to the image memfd are shared with the image cache
+ * of the process. Pages that the guest has written to are private copies, like all other pages.
+ *
+ * @param shared_image The resident memory that is shared through guest image memfds.
+ * @return The resident memory that is private to this VM in bytes.
+ */
+size_t get_resident_guest_memory(size_t *shared_image) {
+    size_t resident = 0;
+    *shared_image = 0;
+
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (pagemap < 0) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Cannot open '/proc/self/pagemap': %s\n",
+                 strerror(errno));
+        output_text += buffer;
+        return 0;
+    }
+
+    // The pagemap is read in chunks, so large slots do not need a large buffer.
+    uint64_t entries[PAGEMAP_CHUNK_ENTRIES];
+    for (uint32_t i = 0; i < memory_slot_count; i++) {
+        memory_slot &slot = memory_slots[i];
+        size_t n_pages = (slot.memory_size + host_page_size - 1) / host_page_size;
+        off_t off = (uint64_t) slot.userspace_addr / host_page_size * sizeof(uint64_t);
+
+        for (size_t done = 0; done < n_pages;) {
+            size_t n = min<size_t>(n_pages - done, PAGEMAP_CHUNK_ENTRIES);
+            ssize_t len = pread(pagemap, entries, n * sizeof(uint64_t),
+                                off + done * sizeof(uint64_t));
+            if (len != (ssize_t) (n * sizeof(uint64_t))) {
+                snprintf(buffer, MAX_STRING_LENGTH, "Error while reading '/proc/self/pagemap': %s\n",
+                         len < 0 ? strerror(errno) : "short read");
+                output_text += buffer;
+                break;
+            }
+
+            for (size_t j = 0; j < n; j++) {
+                // Bit 63: page present, bit 61: page is a file page or shared anonymous memory
+                if (!(entries[j] >> 63 & 1))
+                    continue;
+                if (slot.image_backed && (entries[j] >> 61 & 1))
+                    *shared_image += host_page_size;
+                else
+                    resident += host_page_size;
+            }
+            done += n;
+        }
+    }
+
+    close(pagemap);
+    return resident;
+}
+
+/**
+ * Logs the resident host memory of the VM.
+ */
+void print_resident_guest_memory() {
+    size_t shared_image;
+    size_t resident = get_resident_guest_memory(&shared_image);
+    snprintf(buffer, MAX_STRING_LENGTH, "Resident guest memory: %zu KiB (shared image: %zu KiB)\n",
+             resident / 1024, shared_image / 1024);
+    output_text += buffer;
+}
+
+/**
+ * Returns the data of a MMIO write.
+ */
+uint64_t mmio_write_data() {
+    uint64_t data = 0;
+    memcpy(&data, run->mmio.data, min<size_t>(run->mmio.len, sizeof(data)));
+    return data;
+}
+
+/**
+ * Handles a MMIO write to the free page reporting registers.
+ *
+ * @return true if the write was a free page report, false if not.
+ */
+bool free_page_report_handler() {
+    if (!run->mmio.is_write)
+        return false;
+
+    switch (run->mmio.phys_addr) {
+        case FREE_PAGE_ADDRESS:
+            free_page_address = mmio_write_data();
+            return true;
+        case FREE_PAGE_LENGTH:
+            release_guest_pages(free_page_address, mmio_write_data());
+            return true;
+        default:
+            return false;
+    }
+}
+
 /**
  * Handles a MMIO exit from KVM_RUN.
  */
 void mmio_exit_handler() {
+    if (free_page_report_handler())
+        return;
+
     snprintf(buffer, MAX_STRING_LENGTH, "Is Write: %d - Address: 0x%08llX\n",
              run->mmio.is_write, run->mmio.phys_addr);
     output_text += buffer;
 
     if (run->mmio.is_write) {
-        uint64_t data = 0;
-        for (int j = 0; j < run->mmio.len; j++) {
-            data |= run->mmio.data[j] << 8 * j;
-        }
+        uint64_t data = mmio_write_data();
 
-        mmio_buffer[mmio_buffer_index] = data;
-        mmio_buffer_index++;
+        if (mmio_buffer_index < MAX_VM_RUNS) {
+            mmio_buffer[mmio_buffer_index] = data;
+            mmio_buffer_index++;
+        }
         snprintf(buffer, MAX_STRING_LENGTH, "Guest wrote 0x%08lX (Length: %d)\n", data,
                  run->mmio.len);
         output_text += buffer;
@@ -244,15 +520,66 @@ void close_fd(int fd) {
 }
 
 /**
- * This is a KVM test program for AArch64.
- * As a starting point, this KVM test program for x86 was used: https://lwn.net/Articles/658512/
- * It is explained here: https://lwn.net/Articles/658511/
- * To change the code from x86 to AArch64 the KVM API Documentation (https://www.kernel.org/doc/html/latest/virt/kvm/api.html) and the QEMU source code were used.
+ * Initializes the VCPU for the preferred target of the host CPU with PSCI v0.2 enabled.
+ * This is also used to reset the VCPU after the guest has shut it down.
  */
-int kvm_test(AAssetManager *mgr) {
+void init_vcpu() {
+    /* Get CPU information for VCPU init */
+    snprintf(buffer, MAX_STRING_LENGTH, "Retrieving physical CPU information\n");
+    output_text += buffer;
+    struct kvm_vcpu_init {
+        __u32 target;
+        __u32 features[7];
+    } preferred_target{};
+    ioctl_exit_on_error(vmfd, KVM_ARM_PREFERRED_TARGET, "KVM_ARM_PREFERRED_TARGET",
+                        &preferred_target);
+
+    /* Enable the PSCI v0.2 CPU feature, to be able to shut down the VM */
+    check_vm_extension(KVM_CAP_ARM_PSCI_0_2, "KVM_CAP_ARM_PSCI_0_2");
+    preferred_target.features[0] |= 1 << KVM_ARM_VCPU_PSCI_0_2;
+
+    /* Initialize VCPU */
+    snprintf(buffer, MAX_STRING_LENGTH, "Initializing VCPU\n");
+    output_text += buffer;
+    ioctl_exit_on_error(vcpufd, KVM_ARM_VCPU_INIT, "KVM_ARM_VCPU_INIT", &preferred_target);
+}
+
+/**
+ * Sets a 64 bit register of the VCPU.
+ *
+ * @param reg_id The KVM_SET_ONE_REG identifier of the register.
+ * @param value The value that will be written to the register.
+ */
+void set_register(uint64_t reg_id, uint64_t value) {
+    struct kvm_one_reg reg = {.id = reg_id, .addr = (uint64_t) &value};
+    ioctl_exit_on_error(vcpufd, KVM_SET_ONE_REG, "KVM_SET_ONE_REG", &reg);
+}
+
+/**
+ * Reads a 64 bit register of the VCPU.
+ *
+ * @param reg_id The KVM_GET_ONE_REG identifier of the register.
+ * @return The value of the register.
+ */
+uint64_t get_register(uint64_t reg_id) {
+    uint64_t value = 0;
+    struct kvm_one_reg reg = {.id = reg_id, .addr = (uint64_t) &value};
+    ioctl_exit_on_error(vcpufd, KVM_GET_ONE_REG, "KVM_GET_ONE_REG", &reg);
+    return value;
+}
+
+/**
+ * Creates the VM, sets up its memory, loads the ELF file and creates and initializes the VCPU.
+ * If an error occurs, the parts of the VM that have been set up so far have to be freed with
+ * close_vm().
+ *
+ * @param lazy Whether guest memory is populated lazily on the first guest access. ROM and RAM are
+ * then read from the ELF file instead of the image store.
+ * @return 0 on success, a negative value if an error occurred.
+ */
+int setup_vm(AAssetManager *mgr, bool lazy = false) {
     int ret;
     uint64_t *mem;
-    size_t mmap_size;
 
     /* Get the KVM file descriptor */
     kvm = open("/dev/kvm", O_RDWR | O_CLOEXEC);
@@ -280,97 +607,113 @@ int kvm_test(AAssetManager *mgr) {
     snprintf(buffer, MAX_STRING_LENGTH, "Creating VM\n");
     output_text += buffer;
     vmfd = ioctl_exit_on_error(kvm, KVM_CREATE_VM, "KVM_CREATE_VM", (unsigned long) 0);
+    memory_slot_count = 0;
+    host_page_size = sysconf(_SC_PAGESIZE);
 
     snprintf(buffer, MAX_STRING_LENGTH, "Setting up memory\n");
     output_text += buffer;
     /*
      * MEMORY MAP
-     * One memory block of 0x1000 B will be assigned to every part of the memory:
+     * One memory block of 0x1000 B will be assigned to every part of the memory except the RAM,
+     * which has 0x10000 B, so that lazy population and its prefetching span several pages:
      *
-     * Start      | Name  | Description
-     * -----------+-------+------------
-     * 0x00000000 | ROM   |
-     * 0x04000000 | RAM   |
-     * 0x04010000 | Heap  | increases
-     * 0x0401F000 | Stack | decreases, so the stack pointer is initially 0x04020000
-     * 0x10000000 | MMIO  |
+     * Start      | Name    | Description
+     * -----------+---------+------------
+     * 0x00000000 | ROM     |
+     * 0x04000000 | RAM     | 0x10000 B
+     * 0x04010000 | Heap    | increases
+     * 0x0401F000 | Stack   | decreases, so the stack pointer is initially 0x04020000
+     * 0x0FFFF000 | Session | return trampoline and free page reporter, only mapped for VM sessions
+     * 0x10000000 | MMIO    |
      */
     check_vm_extension(KVM_CAP_USER_MEMORY, "KVM_CAP_USER_MEMORY");
-    /* ROM Memory */
+    check_vm_extension(KVM_CAP_READONLY_MEM, "KVM_CAP_READONLY_MEM");
     memory_mappings[0].guest_phys_addr = 0x0;
     memory_mappings[0].memory_size = MEMORY_BLOCK_SIZE;
-    mem = allocate_memory_to_vm(memory_mappings[0].memory_size, memory_mappings[0].guest_phys_addr);
-    memory_mappings[0].userspace_addr = mem;
-
-    /* RAM Memory */
     memory_mappings[1].guest_phys_addr = 0x04000000;
-    memory_mappings[1].memory_size = MEMORY_BLOCK_SIZE;
-    mem = allocate_memory_to_vm(memory_mappings[1].memory_size, memory_mappings[1].guest_phys_addr);
-    memory_mappings[1].userspace_addr = mem;
+    memory_mappings[1].memory_size = RAM_SIZE;
 
-    ret = copy_elf_into_memory(mgr);
-    if (ret < 0)
-        return ret;
+    lazy_memory = lazy && lazy_memory_init(LAZY_PREFETCH_PAGES) == 0;
+    if (lazy && !lazy_memory) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Lazy memory population not available\n");
+        output_text += buffer;
+    }
+
+    if (lazy_memory) {
+        /* ROM and RAM Memory, populated from the ELF file on first access */
+        ret = map_lazy_image(mgr);
+        if (ret < 0) {
+            snprintf(buffer, MAX_STRING_LENGTH, "Error while mapping guest image lazily\n");
+            output_text += buffer;
+            return ret;
+        }
+    } else {
+        /*
+         * The ELF file is only loaded and copied once per process, later VMs of the process map the
+         * cached image. As the VM state is global, the process runs only one VM at a time, so the
+         * image pages are not shared between concurrently running VMs.
+         */
+        image = get_guest_image(mgr, IMAGE_FILENAME, memory_mappings, N_MEMORY_MAPPINGS,
+                                append_output_line);
+        if (image == nullptr) {
+            snprintf(buffer, MAX_STRING_LENGTH, "Error while loading guest image\n");
+            output_text += buffer;
+            return -1;
+        }
+        guest_entry_address = image->entry_address;
+
+        /* ROM Memory, read-only from the image memfd */
+        mem = map_image_to_vm(image->memfds[0], memory_mappings[0], true);
+        memory_mappings[0].userspace_addr = mem;
+
+        /* RAM Memory, copy-on-write from the image memfd */
+        mem = map_image_to_vm(image->memfds[1], memory_mappings[1], false);
+        memory_mappings[1].userspace_addr = mem;
+    }
 
     /* Heap Memory */
-    allocate_memory_to_vm(MEMORY_BLOCK_SIZE, 0x04010000);
+    allocate_lazy_memory_to_vm(MEMORY_BLOCK_SIZE, 0x04010000);
     /* Stack Memory */
-    allocate_memory_to_vm(MEMORY_BLOCK_SIZE, 0x0401F000);
+    allocate_lazy_memory_to_vm(MEMORY_BLOCK_SIZE, 0x0401F000);
 
     /* MMIO Memory */
-    check_vm_extension(KVM_CAP_READONLY_MEM, "KVM_CAP_READONLY_MEM"); // This will cause a write to 0x10000000, to result in a KVM_EXIT_MMIO.
-    allocate_memory_to_vm(MEMORY_BLOCK_SIZE, 0x10000000, KVM_MEM_READONLY);
+    // The read-only memory will cause a write to 0x10000000, to result in a KVM_EXIT_MMIO.
+    allocate_memory_to_vm(MEMORY_BLOCK_SIZE, MMIO_ADDRESS, KVM_MEM_READONLY);
 
     /* Create a virtual CPU and receive its file descriptor */
     snprintf(buffer, MAX_STRING_LENGTH, "Creating VCPU\n");
     output_text += buffer;
     vcpufd = ioctl_exit_on_error(vmfd, KVM_CREATE_VCPU, "KVM_CREATE_VCPU", (unsigned long) 0);
 
-    /* Get CPU information for VCPU init */
-    snprintf(buffer, MAX_STRING_LENGTH, "Retrieving physical CPU information\n");
-    output_text += buffer;
-    struct kvm_vcpu_init {
-        __u32 target;
-        __u32 features[7];
-    } preferred_target{};
-    ioctl_exit_on_error(vmfd, KVM_ARM_PREFERRED_TARGET, "KVM_ARM_PREFERRED_TARGET",
-                        &preferred_target);
-
-    /* Enable the PSCI v0.2 CPU feature, to be able to shut down the VM */
-    check_vm_extension(KVM_CAP_ARM_PSCI_0_2, "KVM_CAP_ARM_PSCI_0_2");
-    preferred_target.features[0] |= 1 << KVM_ARM_VCPU_PSCI_0_2;
-
-    /* Initialize VCPU */
-    snprintf(buffer, MAX_STRING_LENGTH, "Initializing VCPU\n");
-    output_text += buffer;
-    ioctl_exit_on_error(vcpufd, KVM_ARM_VCPU_INIT, "KVM_ARM_VCPU_INIT", &preferred_target);
+    init_vcpu();
 
     /* Map the shared kvm_run structure and following data. */
     ret = ioctl_exit_on_error(kvm, KVM_GET_VCPU_MMAP_SIZE, "KVM_GET_VCPU_MMAP_SIZE", NULL);
-    mmap_size = ret;
-    if (mmap_size < sizeof(*run)) {
+    run_mmap_size = ret;
+    if (run_mmap_size < sizeof(*run)) {
         snprintf(buffer, MAX_STRING_LENGTH, "KVM_GET_VCPU_MMAP_SIZE unexpectedly small");
         output_text += buffer;
     }
-    void *void_mem = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpufd, 0);
-    run = static_cast<kvm_run *>(void_mem);
-    if (!run) {
-        snprintf(buffer, MAX_STRING_LENGTH, "Error while mmap vcpu");
+    void *void_mem = mmap(NULL, run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpufd, 0);
+    if (void_mem == MAP_FAILED) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Error while mmap vcpu: %s\n", strerror(errno));
         output_text += buffer;
+        return -1;
     }
+    run = static_cast<kvm_run *>(void_mem);
 
-    /* Set program counter to entry address */
     check_vm_extension(KVM_CAP_ONE_REG, "KVM_CAP_ONE_REG");
-    uint64_t pc_id = 0x6030000000100040;
-    uint64_t entry_addr = get_entry_address();
-    snprintf(buffer, MAX_STRING_LENGTH, "Setting program counter to entry address 0x%08lX\n", entry_addr);
-    output_text += buffer;
-    struct kvm_one_reg pc = {.id = pc_id, .addr = (uint64_t)&entry_addr};
-    ret = ioctl_exit_on_error(vcpufd, KVM_SET_ONE_REG, "KVM_SET_ONE_REG", &pc);
-    if (ret < 0)
-        return ret;
+    return 0;
+}
+
+/**
+ * Repeatedly runs the VCPU and handles VM exits until the guest shuts down.
+ *
+ * @return 0 on success, a negative value if KVM_RUN failed.
+ */
+int run_vm() {
+    int ret;
 
-    /* Repeatedly run code and handle VM exits. */
     snprintf(buffer, MAX_STRING_LENGTH, "Running code\n");
     output_text += buffer;
     bool shut_down = false;
@@ -420,13 +763,295 @@ int kvm_test(AAssetManager *mgr) {
         }
     }
 
-    close_fd(vcpufd);
-    close_fd(vmfd);
-    close_fd(kvm);
-
     return 0;
 }
 
+/**
+ * Closes the file descriptors of the VCPU, the VM and KVM and unmaps all memory of the VM.
+ * This also frees a VM whose setup_vm() failed part way.
+ */
+void close_vm() {
+    if (memory_slot_count > 0)
+        print_resident_guest_memory();
+    if (lazy_memory) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Lazily populated pages: %lu\n",
+                 get_lazily_populated_pages());
+        output_text += buffer;
+        lazy_memory_close();
+        lazy_memory = false;
+    }
+    if (lazy_image_fd >= 0) {
+        close_fd(lazy_image_fd);
+        lazy_image_fd = -1;
+    }
+    if (run != nullptr) {
+        munmap(run, run_mmap_size);
+        run = nullptr;
+    }
+    if (vcpufd >= 0) {
+        close_fd(vcpufd);
+        vcpufd = -1;
+    }
+    if (vmfd >= 0) {
+        close_fd(vmfd);
+        vmfd = -1;
+    }
+    for (uint32_t i = 0; i < memory_slot_count; i++) {
+        munmap(memory_slots[i].userspace_addr, memory_slots[i].memory_size);
+    }
+    memory_slot_count = 0;
+    if (kvm >= 0) {
+        close_fd(kvm);
+        kvm = -1;
+    }
+}
+
+/**
+ * This is a KVM test program for AArch64.
+ * As a starting point, this KVM test program for x86 was used: https://lwn.net/Articles/658512/
+ * It is explained here: https://lwn.net/Articles/658511/
+ * To change the code from x86 to AArch64 the KVM API Documentation (https://www.kernel.org/doc/html/latest/virt/kvm/api.html) and the QEMU source code were used.
+ */
+int kvm_test(AAssetManager *mgr) {
+    int ret;
+
+    ret = setup_vm(mgr);
+    if (ret < 0) {
+        close_vm();
+        return ret;
+    }
+
+    /* Set program counter to entry address */
+    uint64_t entry_addr = guest_entry_address;
+    snprintf(buffer, MAX_STRING_LENGTH, "Setting program counter to entry address 0x%08lX\n", entry_addr);
+    output_text += buffer;
+    set_register(REG_PC, entry_addr);
+
+    /* Repeatedly run code and handle VM exits. */
+    ret = run_vm();
+    close_vm();
+
+    return ret;
+}
+
+/**
+ * Writes the return trampoline into the session memory.
+ * Guest functions called through vm_session_call() return to this code via the link register.
+ * The trampoline moves the return value to x4 and issues an HVC with SESSION_RETURN_FUNCTION_ID in w0.
+ * If the HVC is not forwarded to user space by KVM, it falls through and writes the return value
+ * to SESSION_RETURN_ADDRESS, which results in a KVM_EXIT_MMIO.
+ * The return value is kept in x4, because KVM writes its SMCCC return values to x0-x3.
+ */
+void write_session_trampoline(uint32_t *code) {
+    int i = 0;
+    code[i++] = 0xAA0003E4; // mov x4, x0
+    code[i++] = 0x52800000 | ((SESSION_RETURN_FUNCTION_ID & 0xFFFF) << 5); // movz w0, #lo
+    code[i++] = 0x72A00000 | ((SESSION_RETURN_FUNCTION_ID >> 16) << 5); // movk w0, #hi, lsl #16
+    code[i++] = 0xD4000002; // hvc #0
+    code[i++] = 0xAA0403E0; // mov x0, x4
+    code[i++] = 0xD2800002 | ((SESSION_RETURN_ADDRESS & 0xFFFF) << 5); // movz x2, #lo
+    code[i++] = 0xF2A00002 | ((SESSION_RETURN_ADDRESS >> 16) << 5); // movk x2, #hi, lsl #16
+    code[i++] = 0xF9000040; // str x0, [x2]
+    code[i] = 0x14000000; // b .
+}
+
+/**
+ * Writes a guest function that reports a free range through the free page reporting registers:
+ * void report_free_pages(uint64_t address, uint64_t length)
+ * It lets the host release guest memory through the same path a guest driver would use.
+ */
+void write_free_page_reporter(uint32_t *code) {
+    int i = 0;
+    code[i++] = 0xD2800002 | ((FREE_PAGE_ADDRESS & 0xFFFF) << 5); // movz x2, #lo
+    code[i++] = 0xF2A00002 | ((FREE_PAGE_ADDRESS >> 16) << 5); // movk x2, #hi, lsl #16
+    code[i++] = 0xF9000040; // str x0, [x2]
+    code[i++] = 0xF9000441; // str x1, [x2, #8], which is FREE_PAGE_LENGTH
+    code[i] = 0xD65F03C0; // ret
+}
+
+/**
+ * Asks KVM to forward HVCs with SESSION_RETURN_FUNCTION_ID to user space as KVM_EXIT_HYPERCALL.
+ * This is only possible with the SMCCC filter of newer kernels. Without it, the session return
+ * falls back to a MMIO write.
+ */
+void forward_session_return_hvc() {
+#ifdef KVM_ARM_VM_SMCCC_FILTER
+    struct kvm_smccc_filter filter = {
+            .base = SESSION_RETURN_FUNCTION_ID,
+            .nr_functions = 1,
+            .action = KVM_SMCCC_FILTER_FWD_TO_USER,
+    };
+    struct kvm_device_attr attr = {
+            .group = KVM_ARM_VM_SMCCC_CTRL,
+            .attr = KVM_ARM_VM_SMCCC_FILTER,
+            .addr = (uint64_t) &filter,
+    };
+    if (ioctl(vmfd, KVM_SET_DEVICE_ATTR, &attr) == 0) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Session returns via HVC\n");
+        output_text += buffer;
+        return;
+    }
+#endif
+    snprintf(buffer, MAX_STRING_LENGTH, "Session returns via MMIO\n");
+    output_text += buffer;
+}
+
+/**
+ * Completes a pending MMIO exit without running guest code.
+ * KVM finishes a MMIO exit, and skips the MMIO instruction, only when KVM_RUN is entered again.
+ * Without this, the next session call would skip the first instruction of its function and a
+ * pending MMIO read would overwrite one of its registers.
+ */
+void complete_mmio_exit() {
+    run->immediate_exit = 1;
+    if (ioctl(vcpufd, KVM_RUN, NULL) < 0 && errno != EINTR) {
+        snprintf(buffer, MAX_STRING_LENGTH, "System call 'KVM_RUN' failed: %d - %s\n",
+                 errno, strerror(errno));
+        output_text += buffer;
+    }
+    run->immediate_exit = 0;
+}
+
+/**
+ * Handles a MMIO exit of a session call. Unlike mmio_exit_handler(), this does not log, so that
+ * a long-lived session does not grow output_text.
+ */
+void session_mmio_exit_handler() {
+    if (free_page_report_handler() || !run->mmio.is_write)
+        return;
+    if (session_output.size() < SESSION_MAX_OUTPUT)
+        session_output += (char) mmio_write_data();
+}
+
+/**
+ * Boots a VM that stays alive across several calls of vm_session_call().
+ *
+ * @param lazy Whether guest memory is populated lazily on the first guest access.
+ * @return 0 on success, SESSION_EAGER_MEMORY if lazy population was requested but is not available
+ * and the memory was set up eagerly instead, a negative value if an error occurred. After an error
+ * the session is already closed.
+ */
+int vm_session_open(AAssetManager *mgr, bool lazy) {
+    int ret = setup_vm(mgr, lazy);
+    if (ret < 0) {
+        close_vm();
+        return ret;
+    }
+
+    uint64_t *mem = allocate_memory_to_vm(MEMORY_BLOCK_SIZE, SESSION_TRAMPOLINE_ADDRESS,
+                                          KVM_MEM_READONLY);
+    write_session_trampoline(reinterpret_cast<uint32_t *>(mem));
+    write_free_page_reporter(reinterpret_cast<uint32_t *>(mem) +
+                             (SESSION_FREE_PAGE_REPORTER_ADDRESS - SESSION_TRAMPOLINE_ADDRESS) / 4);
+    forward_session_return_hvc();
+    return lazy && !lazy_memory ? SESSION_EAGER_MEMORY : 0;
+}
+
+/**
+ * Calls a function in the guest of the open session and waits for it to return.
+ * The arguments are passed in x0-x7 according to the AArch64 procedure call standard.
+ * Each call starts with an empty stack, so no guest state is kept on the stack between calls.
+ *
+ * @param entry_addr The guest address of the function to call.
+ * @param args The arguments of the function.
+ * @param n_args The number of arguments, at most SESSION_MAX_ARGS.
+ * @param result The return value of the function (x0).
+ * The MMIO output of the call is available in session_output afterwards.
+ * @return 0 on success, -1 if the guest did not return to the trampoline.
+ */
+int vm_session_call(uint64_t entry_addr, const uint64_t *args, int n_args, uint64_t *result) {
+    if (n_args > SESSION_MAX_ARGS) {
+        snprintf(buffer, MAX_STRING_LENGTH, "Too many arguments for session call: %d\n", n_args);
+        output_text += buffer;
+        return -1;
+    }
+
+    /*
+     * A call can end with a pending MMIO exit, e.g. the MMIO session return or a call that was
+     * aborted in the middle of its output. It has to be completed before the PC is set.
+     */
+    if (run->exit_reason == KVM_EXIT_MMIO)
+        complete_mmio_exit();
+
+    set_register(REG_PC, entry_addr);
+    set_register(REG_SP_EL1, STACK_TOP);
+    set_register(REG_X(30), SESSION_TRAMPOLINE_ADDRESS);
+    for (int i = 0; i < n_args; i++) {
+        set_register(REG_X(i), args[i]);
+    }
+    session_output.clear();
+
+    for (int i = 0; i < SESSION_MAX_EXITS; i++) {
+        int ret = ioctl(vcpufd, KVM_RUN, NULL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            snprintf(buffer, MAX_STRING_LENGTH, "System call 'KVM_RUN' failed: %d - %s\n",
+                     errno, strerror(errno));
+            output_text += buffer;
+            return ret;
+        }
+
+        switch (run->exit_reason) {
+            case KVM_EXIT_MMIO:
+                if (run->mmio.is_write && run->mmio.phys_addr == SESSION_RETURN_ADDRESS) {
+                    *result = mmio_write_data();
+                    return 0;
+                }
+                session_mmio_exit_handler();
+                break;
+            case KVM_EXIT_HYPERCALL:
+                if (run->hypercall.nr == SESSION_RETURN_FUNCTION_ID) {
+                    *result = get_register(REG_X(4));
+                    return 0;
+                }
+                snprintf(buffer, MAX_STRING_LENGTH, "Unexpected hypercall 0x%08llX\n",
+                         run->hypercall.nr);
+                output_text += buffer;
+                return -1;
+            case KVM_EXIT_SYSTEM_EVENT:
+                // The guest shut down instead of returning. Reset the VCPU to keep the session usable.
+                snprintf(buffer, MAX_STRING_LENGTH, "Session call ended with a system event\n");
+                output_text += buffer;
+                print_system_event_exit_reason();
+                init_vcpu();
+                return -1;
+            case KVM_EXIT_INTR:
+                break;
+            default:
+                snprintf(buffer, MAX_STRING_LENGTH, "Session call failed. Exit Reason: %d\n",
+                         run->exit_reason);
+                output_text += buffer;
+                return -1;
+        }
+    }
+
+    snprintf(buffer, MAX_STRING_LENGTH, "Session call did not return after %d exits\n",
+             SESSION_MAX_EXITS);
+    output_text += buffer;
+    return -1;
+}
+
+/**
+ * Lets the guest of the open session report a free range, so that its host memory is released.
+ *
+ * @param guest_addr The guest address of the free range.
+ * @param len The length of the free range.
+ * @return 0 on success, -1 if the guest did not return.
+ */
+int vm_session_report_free_pages(uint64_t guest_addr, uint64_t len) {
+    uint64_t args[2] = {guest_addr, len};
+    uint64_t result;
+    return vm_session_call(SESSION_FREE_PAGE_REPORTER_ADDRESS, args, 2, &result);
+}
+
+/**
+ * Tears down the VM of the session.
+ */
+void vm_session_close() {
+    close_vm();
+}
+
 extern "C" JNIEXPORT jstring JNICALL
 Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_kvmHelloWorld(
         JNIEnv *env,
@@ -448,4 +1073,89 @@ Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_getKvmHelloWo
         JNIEnv *env,
         jobject thiz) {
     return env->NewStringUTF(output_text.c_str());
-}
\ No newline at end of file
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_vmSessionOpen(
+        JNIEnv *env,
+        jobject thiz,
+        jobject assetManager,
+        jboolean lazy) {
+    AAssetManager* mgr = AAssetManager_fromJava(env, assetManager);
+    return vm_session_open(mgr, lazy);
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_vmSessionCall(
+        JNIEnv *env,
+        jobject thiz,
+        jlong entry,
+        jlongArray args) {
+    uint64_t call_args[SESSION_MAX_ARGS];
+    int n_args = env->GetArrayLength(args);
+    if (n_args <= SESSION_MAX_ARGS)
+        env->GetLongArrayRegion(args, 0, n_args, reinterpret_cast<jlong *>(call_args));
+
+    // Every value is a valid result, so errors are reported as exception.
+    uint64_t result;
+    if (vm_session_call(entry, call_args, n_args, &result) < 0) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "Session call failed");
+        return 0;
+    }
+    return result;
+}
+
+extern "C" JNIEXPORT jlong JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_vmSessionSymbol(
+        JNIEnv *env,
+        jobject thiz,
+        jobject assetManager,
+        jstring name) {
+    AAssetManager* mgr = AAssetManager_fromJava(env, assetManager);
+    const char *symbol = env->GetStringUTFChars(name, nullptr);
+    uint64_t address;
+    int ret = get_symbol_address(mgr, IMAGE_FILENAME, symbol, &address);
+    env->ReleaseStringUTFChars(name, symbol);
+    if (ret < 0) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "Symbol not found");
+        return 0;
+    }
+    return address;
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_getVmSessionOutput(
+        JNIEnv *env,
+        jobject thiz) {
+    return env->NewStringUTF(session_output.c_str());
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_vmSessionClose(
+        JNIEnv *env,
+        jobject thiz) {
+    vm_session_close();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_vmSessionReportFreePages(
+        JNIEnv *env,
+        jobject thiz,
+        jlong address,
+        jlong length) {
+    if (vm_session_report_free_pages(address, length) < 0)
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "Free page report failed");
+}
+
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_edu_hm_karbaumer_lenz_android_1kvm_1hello_1world_MainActivity_getResidentGuestMemory(
+        JNIEnv *env,
+        jobject thiz) {
+    size_t shared_image;
+    size_t resident = get_resident_guest_memory(&shared_image);
+    jlong values[2] = {(jlong) resident, (jlong) shared_image};
+
+    jlongArray result = env->NewLongArray(2);
+    env->SetLongArrayRegion(result, 0, 2, values);
+    return result;
+}
@@ -0,0 +1,316 @@
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include <android/log.h>
+
+#include "lazy_memory.h"
+
+#define TAG "HELLO_KVM"
+
+// A registered region and where its content comes from
+struct lazy_region {
+    uint64_t start;
+    size_t len;
+    int source_fd;
+    std::vector<lazy_extent> extents;
+};
+
+int uffd = -1;
+int stop_fd = -1;
+std::thread fault_handler;
+
+std::vector<lazy_region> regions;
+std::mutex regions_lock;
+
+size_t page_size;
+int prefetch;
+std::atomic<uint64_t> populated_pages(0);
+
+/**
+ * Finds the registered region that contains the address.
+ *
+ * @param addr The host address to search for.
+ * @param region The region that contains the address.
+ * @return true if a region was found, false if not.
+ */
+bool find_lazy_region(uint64_t addr, lazy_region *region) {
+    std::lock_guard<std::mutex> guard(regions_lock);
+    for (const lazy_region &r: regions) {
+        if (r.start <= addr && addr < r.start + r.len) {
+            *region = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether a page of a region contains content from the source file.
+ */
+bool page_has_extent(const lazy_region &region, uint64_t page) {
+    size_t page_offset = page - region.start;
+    for (const lazy_extent &e: region.extents) {
+        if (e.offset < page_offset + page_size && page_offset < e.offset + e.len)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Reads one page of a region from its source file. Everything outside of the extents is zero.
+ *
+ * @return true on success, false if an I/O error occurred or the source file is too short.
+ */
+bool read_source_page(const lazy_region &region, uint64_t page, uint8_t *page_buffer) {
+    size_t page_offset = page - region.start;
+    memset(page_buffer, 0, page_size);
+
+    for (const lazy_extent &e: region.extents) {
+        size_t start = std::max(e.offset, page_offset);
+        size_t end = std::min(e.offset + e.len, page_offset + page_size);
+        if (start >= end)
+            continue;
+
+        off_t off = e.source_offset + (start - e.offset);
+        uint8_t *dst = page_buffer + (start - page_offset);
+        size_t read_b = 0;
+        while (read_b < end - start) {
+            ssize_t n = pread(region.source_fd, dst + read_b, end - start - read_b, off + read_b);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                __android_log_print(ANDROID_LOG_INFO, TAG, "Reading page 0x%08lX failed: %s", page,
+                                    n < 0 ? strerror(errno) : "end of file");
+                return false;
+            }
+            read_b += n;
+        }
+    }
+    return true;
+}
+
+/**
+ * Populates one page of a region without waking up the faulting thread.
+ *
+ * @param region The region that contains the page.
+ * @param page The host address of the page.
+ * @param page_buffer A buffer of one page for reading from the source file.
+ * @return true if the page is populated, false if an error occurred.
+ */
+bool populate_page(const lazy_region &region, uint64_t page, uint8_t *page_buffer) {
+    int ret;
+    if (!page_has_extent(region, page)) {
+        struct uffdio_zeropage zeropage = {
+                .range = {.start = page, .len = page_size},
+                .mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE,
+        };
+        ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zeropage);
+    } else {
+        if (!read_source_page(region, page, page_buffer))
+            return false;
+
+        struct uffdio_copy copy = {
+                .dst = page,
+                .src = (uint64_t) page_buffer,
+                .len = page_size,
+                .mode = UFFDIO_COPY_MODE_DONTWAKE,
+        };
+        ret = ioctl(uffd, UFFDIO_COPY, &copy);
+    }
+
+    // EEXIST means the page has already been populated, e.g. by an earlier prefetch.
+    if (ret == 0) {
+        populated_pages++;
+        return true;
+    }
+    if (errno == EEXIST)
+        return true;
+    __android_log_print(ANDROID_LOG_INFO, TAG, "Populating page 0x%08lX failed: %s", page,
+                        strerror(errno));
+    return false;
+}
+
+/**
+ * Makes the guest access to a page that could not be populated fail.
+ * The page is made inaccessible and unregistered, which wakes up the faulting thread.
+ * The retried fault then fails, so KVM_RUN returns EFAULT instead of the guest reading wrong data.
+ *
+ * @param page The host address of the page.
+ */
+void fail_page_fault(uint64_t page) {
+    mprotect(reinterpret_cast<void *>(page), page_size, PROT_NONE);
+    struct uffdio_range range = {.start = page, .len = page_size};
+    ioctl(uffd, UFFDIO_UNREGISTER, &range);
+}
+
+/**
+ * Populates the faulting page and the prefetched pages after it, then wakes up the faulting thread.
+ *
+ * @param addr The faulting host address.
+ * @param page_buffer A buffer of one page for reading from the source file.
+ */
+void handle_page_fault(uint64_t addr, uint8_t *page_buffer) {
+    uint64_t page = addr & ~(uint64_t) (page_size - 1);
+
+    lazy_region region;
+    if (!find_lazy_region(page, &region)) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "Page fault outside of lazy regions: 0x%08lX",
+                            addr);
+        fail_page_fault(page);
+        return;
+    }
+    if (!populate_page(region, page, page_buffer)) {
+        fail_page_fault(page);
+        return;
+    }
+
+    // Prefetching is best effort, a failed page is populated again on its own fault.
+    uint64_t end = region.start + region.len;
+    for (int i = 1; i <= prefetch && page + i * page_size < end; i++) {
+        populate_page(region, page + i * page_size, page_buffer);
+    }
+
+    struct uffdio_range range = {.start = page, .len = page_size};
+    ioctl(uffd, UFFDIO_WAKE, &range);
+}
+
+/**
+ * The fault handling thread. Reads page fault events from the userfaultfd until it is stopped.
+ */
+void handle_page_faults() {
+    std::vector<uint8_t> page_buffer(page_size);
+    struct pollfd fds[2] = {
+            {.fd = uffd, .events = POLLIN},
+            {.fd = stop_fd, .events = POLLIN},
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            __android_log_print(ANDROID_LOG_INFO, TAG, "poll on userfaultfd failed: %s",
+                                strerror(errno));
+            return;
+        }
+        if (fds[1].revents & POLLIN)
+            return;
+
+        struct uffd_msg msg;
+        ssize_t n = read(uffd, &msg, sizeof(msg));
+        if (n != sizeof(msg))
+            continue;
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            handle_page_fault(msg.arg.pagefault.address, page_buffer.data());
+    }
+}
+
+/**
+ * Creates a userfaultfd that also handles the faults KVM raises in the kernel.
+ *
+ * @return The file descriptor or -1 if userfaultfd is not available.
+ */
+int open_userfaultfd() {
+    /*
+     * The guest faults are raised by KVM in the kernel, so UFFD_USER_MODE_ONLY can not be used.
+     * Without it, unprivileged processes get EPERM on Linux 5.11+ unless vm.unprivileged_userfaultfd
+     * is 1, which it is not on Android. Since Linux 6.1, /dev/userfaultfd is an alternative whose
+     * access is controlled by its file permissions instead.
+     */
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd >= 0)
+        return fd;
+    __android_log_print(ANDROID_LOG_INFO, TAG, "userfaultfd failed: %s", strerror(errno));
+
+#ifdef USERFAULTFD_IOC_NEW
+    int dev = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+    if (dev < 0) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "Cannot open '/dev/userfaultfd': %s",
+                            strerror(errno));
+        return -1;
+    }
+    fd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0)
+        __android_log_print(ANDROID_LOG_INFO, TAG, "USERFAULTFD_IOC_NEW failed: %s",
+                            strerror(errno));
+    close(dev);
+#endif
+    return fd;
+}
+
+int lazy_memory_init(int prefetch_pages) {
+    uffd = open_userfaultfd();
+    if (uffd < 0)
+        return -1;
+
+    struct uffdio_api api = {.api = UFFD_API, .features = 0};
+    if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "UFFDIO_API failed: %s", strerror(errno));
+        close(uffd);
+        uffd = -1;
+        return -1;
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "eventfd failed: %s", strerror(errno));
+        close(uffd);
+        uffd = -1;
+        return -1;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    prefetch = prefetch_pages;
+    populated_pages = 0;
+    fault_handler = std::thread(handle_page_faults);
+    return 0;
+}
+
+int register_lazy_region(void *mem, size_t len, int source_fd, const lazy_extent *extents,
+                         int n_extents) {
+    struct uffdio_register reg = {
+            .range = {.start = (uint64_t) mem, .len = len},
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0) {
+        __android_log_print(ANDROID_LOG_INFO, TAG, "UFFDIO_REGISTER failed: %s", strerror(errno));
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(regions_lock);
+    regions.push_back({(uint64_t) mem, len, source_fd,
+                       std::vector<lazy_extent>(extents, extents + n_extents)});
+    return 0;
+}
+
+uint64_t get_lazily_populated_pages() {
+    return populated_pages;
+}
+
+void lazy_memory_close() {
+    if (uffd < 0)
+        return;
+
+    uint64_t stop = 1;
+    write(stop_fd, &stop, sizeof(stop));
+    fault_handler.join();
+
+    close(stop_fd);
+    close(uffd);
+    stop_fd = -1;
+    uffd = -1;
+
+    std::lock_guard<std::mutex> guard(regions_lock);
+    regions.clear();
+}
@@ -0,0 +1,55 @@
+#ifndef ANDROID_KVM_HELLO_WORLD_LAZY_MEMORY_H
+#define ANDROID_KVM_HELLO_WORLD_LAZY_MEMORY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+// Source file descriptor for regions that are populated with zero pages
+#define LAZY_ZERO_SOURCE -1
+
+// A part of a region whose content is read from the source file
+struct lazy_extent {
+    size_t offset;
+    off_t source_offset;
+    size_t len;
+};
+
+/**
+ * Creates a userfaultfd and starts the thread that handles its page faults.
+ * This must be called before any other function.
+ *
+ * @param prefetch_pages The number of pages after a faulting page that are populated as well.
+ * @return 0 on success, -1 if userfaultfd is not available. Unprivileged processes usually get
+ * EPERM, e.g. Android apps, unless they may open /dev/userfaultfd.
+ */
+int lazy_memory_init(int prefetch_pages);
+
+/**
+ * Registers a region of private anonymous memory, so that its pages are only populated when they
+ * are touched for the first time. The extents of the region are read from the source file, e.g.
+ * the segments of an ELF file, everything else is zero. Pages without extents are zero pages.
+ * If a page can not be populated, the access to it fails instead of returning wrong content.
+ *
+ * @param mem The page aligned start of the region.
+ * @param len The length of the region, a multiple of the page size.
+ * @param source_fd The file the extents are read from or LAZY_ZERO_SOURCE. It has to stay open
+ * until lazy_memory_close().
+ * @param extents The parts of the region that are read from the source file.
+ * @param n_extents The number of extents, 0 for a region of zero pages.
+ * @return 0 on success, -1 if an error occurred.
+ */
+int register_lazy_region(void *mem, size_t len, int source_fd, const lazy_extent *extents,
+                         int n_extents);
+
+/**
+ * Returns the number of pages that have been populated by the fault handler so far.
+ */
+uint64_t get_lazily_populated_pages();
+
+/**
+ * Stops the fault handling thread and closes the userfaultfd. This unregisters all regions.
+ */
+void lazy_memory_close();
+
+#endif //ANDROID_KVM_HELLO_WORLD_LAZY_MEMORY_H
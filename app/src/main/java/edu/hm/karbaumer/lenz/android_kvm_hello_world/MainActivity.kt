@@ -21,11 +21,37 @@ class MainActivity : AppCompatActivity() {
         setContentView(binding.root)
 
         mgr = resources.assets
-        binding.vmOutput.text = kvmHelloWorld(mgr)
+        binding.vmOutput.text = kvmHelloWorld(mgr) + runVmSession()
 
         binding.cppOutput.text = getKvmHelloWorldLog()
     }
 
+    /**
+     * Calls the main function of the guest through a VM session and returns its output.
+     * The session requests lazy memory population, which falls back to eager setup if the app
+     * is not allowed to use userfaultfd.
+     * Afterwards the guest reports its heap and stack as free, and the resident guest memory before
+     * and after the release is appended to the output.
+     */
+    private fun runVmSession(): String {
+        if (vmSessionOpen(mgr, true) < 0)
+            return ""
+        return try {
+            vmSessionCall(vmSessionSymbol(mgr, "main"), longArrayOf())
+            val output = getVmSessionOutput()
+
+            val before = getResidentGuestMemory()
+            vmSessionReportFreePages(HEAP_ADDRESS, STACK_TOP - HEAP_ADDRESS)
+            val after = getResidentGuestMemory()
+            output + "\nResident guest memory: ${before[0] / 1024} KiB -> ${after[0] / 1024} KiB " +
+                    "(shared image: ${before[1] / 1024} KiB -> ${after[1] / 1024} KiB)"
+        } catch (e: RuntimeException) {
+            ""
+        } finally {
+            vmSessionClose()
+        }
+    }
+
     /**
      * A native method that is implemented by the 'android_kvm_hello_world' native library,
      * which is packaged with this application.
@@ -34,7 +60,50 @@ class MainActivity : AppCompatActivity() {
 
     external fun getKvmHelloWorldLog(): String
 
+    /**
+     * Boots a VM that stays alive across several calls of [vmSessionCall].
+     * With [lazy], guest memory is only populated when the guest touches it.
+     * Returns 0 on success, 1 if lazy population is not available and memory was set up eagerly,
+     * a negative value if an error occurred. After an error the session is already closed.
+     */
+    external fun vmSessionOpen(mgr: AssetManager, lazy: Boolean): Int
+
+    /**
+     * Calls the guest function at [entry] with up to 8 [args] and returns its result.
+     * Throws a RuntimeException if the guest did not return.
+     */
+    external fun vmSessionCall(entry: Long, args: LongArray): Long
+
+    /**
+     * Returns the guest address of the symbol [name]. Throws a RuntimeException if it is not found.
+     */
+    external fun vmSessionSymbol(mgr: AssetManager, name: String): Long
+
+    /**
+     * Returns the MMIO output of the last [vmSessionCall].
+     */
+    external fun getVmSessionOutput(): String
+
+    /**
+     * Lets the guest of the session report the range at [address] with [length] bytes as free,
+     * so that its host memory is released. Throws a RuntimeException if the report failed.
+     */
+    external fun vmSessionReportFreePages(address: Long, length: Long)
+
+    external fun vmSessionClose()
+
+    /**
+     * Returns the resident host memory of the guest memory of the current VM in bytes:
+     * the memory private to the VM and the guest image memory shared with the image cache.
+     * Both are 0 if no VM is open, so this has to be called before [vmSessionClose].
+     */
+    external fun getResidentGuestMemory(): LongArray
+
     companion object {
+        // The guest heap and stack, see the memory map in kvm_test.cpp
+        private const val HEAP_ADDRESS = 0x04010000L
+        private const val STACK_TOP = 0x04020000L
+
         // Used to load the 'android_kvm_hello_world' library on application startup.
         init {
             System.loadLibrary("android_kvm_hello_world")